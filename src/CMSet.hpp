@@ -4,8 +4,16 @@
 #define CMSet_HPP
 
 #include "Node.hpp"
+#include "WorkerPool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <iostream>
 #include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 
 //abstract class 'CMSet', concrete implementations derive this interface
@@ -22,28 +30,143 @@ class CMSet {
     virtual bool contains (const T& element) = 0; //good practice to include the 'const' method signature
     virtual int  count (const T& element) = 0; //in other words, the multiplicity
     virtual void add (const T& element) = 0; //adding an element to the bag
+    virtual void add (const T& element, int n) = 0; //adding n copies of an element at once (no-op if n <= 0)
     virtual bool remove (const T& element) = 0; //removing an element form the bag
-
+    virtual int  remove (const T& element, int n) = 0; //removing up to n copies at once, returns how many were removed
+    virtual void for_each (const std::function<void(const T&, int)>& visit) = 0; //visits every element once, with its multiplicity
+
+    //whether add/remove may be called from several threads at once without breaking the set,
+    //the algebra below only spreads its writes across the worker pool when this holds (and is worth it)
+    virtual bool parallel_writes() const { return false; }
+
+
+    /*======= Multiset Algebra ==========*/
+    // These update 'this' in place using multiplicities from 'other', and accept any pair of strategies.
+    // 'other' is only read through a single for_each() snapshot, so its readers are never held up for longer than that copy.
+    // The work is then split into partitions and applied through the normal add/remove methods, on the shared WorkerPool
+    // if parallel_writes() allows it, otherwise on the calling thread.
+    // merge_from and difference_with change each element with a single add(e, n) / remove(e, n), so each of those updates is linearizable.
+    // union_with and intersect_with read count(e) and then add/remove the difference, which are two separate operations:
+    // a concurrent writer of the same element in between can make the result overshoot the max (or undershoot the min).
+    // None of the four is atomic as a whole with respect to concurrent writers of 'this'.
+
+    //copies every (element, multiplicity) pair out of the set
+    std::vector<std::pair<T, int>> snapshot() {
+        std::vector<std::pair<T, int>> items;
+        for_each([&](const T& element, int count) {
+            items.push_back(std::make_pair(element, count));
+        });
+        return items;
+    }
+
+    //sum: count(e) becomes count(e) + other.count(e)
+    void merge_from(CMSet<T>& other) {
+        parallel_apply(other.snapshot(), [this](const T& element, int other_count) {
+            add(element, other_count);
+        });
+    }
+
+    //union: count(e) becomes max(count(e), other.count(e))
+    void union_with(CMSet<T>& other) {
+        parallel_apply(other.snapshot(), [this](const T& element, int other_count) {
+            add(element, other_count - count(element));
+        });
+    }
+
+    //intersection: count(e) becomes min(count(e), other.count(e)), elements missing from 'other' are removed entirely
+    //'other' is snapshotted once into a hash map, so looking elements up never goes back to it (T needs a std::hash)
+    void intersect_with(CMSet<T>& other) {
+        std::unordered_map<T, int> other_counts;
+        for (const auto& item : other.snapshot()) {
+            other_counts[item.first] = item.second;
+        }
+        parallel_apply(snapshot(), [this, &other_counts](const T& element, int own_count) {
+            auto found = other_counts.find(element);
+            int keep = (found == other_counts.end()) ? 0 : found->second;
+            remove(element, count(element) - keep);
+        });
+    }
+
+    //difference: count(e) becomes max(0, count(e) - other.count(e))
+    void difference_with(CMSet<T>& other) {
+        parallel_apply(other.snapshot(), [this](const T& element, int other_count) {
+            remove(element, other_count); //stops at 0 by itself
+        });
+    }
 
     virtual ~CMSet() {} //destructor
 
+    protected:
+
+    static constexpr size_t MIN_PARTITION = 64; //fewer elements than this per partition isn't worth handing to another thread
+
+    //splits 'items' into contiguous partitions and applies 'apply' to each element, spreading the partitions over the worker pool
+    void parallel_apply(const std::vector<std::pair<T, int>>& items, const std::function<void(const T&, int)>& apply) {
+        size_t num_partitions = (items.size() + MIN_PARTITION - 1) / MIN_PARTITION;
+
+        if (num_partitions <= 1 || !parallel_writes()) {
+            for (const auto& item : items) {
+                apply(item.first, item.second); //run inline
+            }
+            return;
+        }
+
+        num_partitions = std::min(num_partitions, 4 * (WorkerPool::shared().size() + 1)); //a few per thread, to even out the load
+
+        size_t partition_size = (items.size() + num_partitions - 1) / num_partitions;
+        WorkerPool::shared().run(num_partitions, [&](size_t partition) {
+            size_t end = std::min((partition + 1) * partition_size, items.size());
+            for (size_t i = partition * partition_size; i < end; ++i) {
+                apply(items[i].first, items[i].second);
+            }
+        });
+    }
+
 };
 
 
 /**
  * Single Lock Implementation
  * (Coarse-grained Synchronisation)
+ *
+ * Instrumented = true counts contended lock acquisitions, which CMSet_Adaptive samples.
+ * It is off for the standalone strategy, so the benchmarks measure a plain lock.
 */
-template <typename T>
+template <typename T, bool Instrumented = false>
 class CMSet_Lock : public CMSet<T> {
     private:
         mutable std::mutex mtx; // mutex to protect linked list
+        std::atomic<long> contended{0}; // number of acquisitions that had to wait for another thread (only when Instrumented)
+
+        //acquires the mutex, counting it as contended if another thread was already holding it
+        std::unique_lock<std::mutex> acquire() {
+            if constexpr (!Instrumented) {
+                return std::unique_lock<std::mutex>(mtx);
+            } else {
+                std::unique_lock<std::mutex> lock(mtx, std::try_to_lock);
+                if (!lock.owns_lock()) {
+                    contended.fetch_add(1, std::memory_order_relaxed);
+                    lock.lock();
+                }
+                return lock;
+            }
+        }
+
     public:
 
         CMSet_Lock() : CMSet<T>() {} //constructor
 
+        //bulk-load constructor, links one node per (element, multiplicity) pair in a single pass
+        explicit CMSet_Lock(const std::vector<std::pair<T, int>>& items) : CMSet<T>() {
+            for (auto it = items.rbegin(); it != items.rend(); ++it) { //built back-to-front so the list keeps the order of 'items'
+                Node<T>* newNode = new Node<T>(it->first, it->second);
+                newNode->next = this->head;
+                this->head = newNode;
+            }
+        }
+
         bool contains(const T& element) override {
-            std::lock_guard<std::mutex> lock(mtx); //RAII-style, meaning that lock is unlocked once we leave scope
+            std::unique_lock<std::mutex> lock = acquire(); //RAII-style, meaning that lock is unlocked once we leave scope
 
 
             //traverses the list, checking if the current node data matches the element data
@@ -60,7 +183,7 @@ class CMSet_Lock : public CMSet<T> {
 
 
         int count(const T& element) override {
-            std::lock_guard<std::mutex> lock(mtx);
+            std::unique_lock<std::mutex> lock = acquire();
 
             Node<T>* current = this->head;
             while (current != nullptr) {
@@ -74,41 +197,56 @@ class CMSet_Lock : public CMSet<T> {
         }
 
         void add(const T& element) override {
-            std::lock_guard<std::mutex> lock(mtx);
+            add(element, 1);
+        }
+
+        void add(const T& element, int n) override {
+            if (n <= 0) {
+                return;
+            }
+            std::unique_lock<std::mutex> lock = acquire();
 
             Node<T>* current = this->head;
             while (current != nullptr) {
                 if (current->data == element) { //if node that matches is found
-                    current->count++; // return count+1
+                    current->count += n; // return count+n
                     return; 
                 }
                 current = current->next;
             }
 
             //if element does not exist
-            Node<T>* newNode = new Node<T>(element);
+            Node<T>* newNode = new Node<T>(element, n);
             newNode->next = this->head;
             this->head = newNode; //new node at the front of the list
         }
 
         bool remove(const T& element) override {
-            std::lock_guard<std::mutex> lock(mtx);
+            return remove(element, 1) == 1;
+        }
+
+        int remove(const T& element, int n) override {
+            if (n <= 0) {
+                return 0;
+            }
+            std::unique_lock<std::mutex> lock = acquire();
 
             Node<T>* current = this->head;
             Node<T>* pred = nullptr;
             while (current != nullptr) {
                 if (current->data == element) {
-                    if (current->count > 1) { //if multiplicity/count is greater than 1, we just decrement by 1
-                        current->count--;
-                        return true;
+                    if (current->count > n) { //if multiplicity/count is greater than n, we just decrement by n
+                        current->count -= n;
+                        return n;
                     } else {
+                        int removed = current->count; //every copy goes, so the node does too
                         if (pred == nullptr) { //if there is no pred node, we set the 'head' to the succeeding node
                             this->head = current->next;
                         } else {
                             pred->next = current->next; // pass pred's next value to current's succeeding node
                         }
                         delete current; // physically remove current
-                        return true;
+                        return removed;
                     }
                 }
                 //continue traversing linked list
@@ -116,7 +254,23 @@ class CMSet_Lock : public CMSet<T> {
                 current = current->next;
             }
 
-            return false; //element not found, so return false
+            return 0; //element not found, so nothing removed
+        }
+
+        void for_each(const std::function<void(const T&, int)>& visit) override {
+            std::unique_lock<std::mutex> lock = acquire();
+
+            for (Node<T>* current = this->head; current != nullptr; current = current->next) {
+                visit(current->data, current->count);
+            }
+        }
+
+        //safe, but every partition would just queue on the single lock, so there is nothing to gain
+        bool parallel_writes() const override { return false; }
+
+        //used by CMSet_Adaptive to sample contention (always 0 unless Instrumented)
+        long contended_acquires() const {
+            return contended.load(std::memory_order_relaxed);
         }
 
         // Destructor, destroys the object and deallocates all the nodes in the list
@@ -200,6 +354,13 @@ class CMSet_O : public CMSet<T> {
         // includes tracking a 'pred' node and then locking the predecessor ensures that no other thread can modify the 'next' pointer of the predecessor at the same time,
         // also list integrity is maintained this way, preventing dangling pointers or broken chains, this could happen if another thread concurrently changes the list structure.
         void add(const T& element) override {
+            add(element, 1);
+        }
+
+        void add(const T& element, int n) override {
+            if (n <= 0) {
+                return;
+            }
 
             Node<T>* pred = nullptr; //predecessor
             Node<T>* current;
@@ -215,7 +376,7 @@ class CMSet_O : public CMSet<T> {
 
                         if (is_valid(pred, current)) { //check if node is valid (not been deleted)
                             // update the node as it exists and is valid 
-                            current->count++;
+                            current->count += n;
                             if (pred != nullptr) { pred->mtx.unlock(); }
                             current->mtx.unlock();
                             return;
@@ -239,7 +400,7 @@ class CMSet_O : public CMSet<T> {
                 if (current == nullptr) { //if element does not exist
 
                     //attempts to add new node at beginning 
-                    Node<T>* newNode = new Node<T>(element);
+                    Node<T>* newNode = new Node<T>(element, n);
                     if(this->head != nullptr) {
                         this->head->mtx.lock(); 
                     }//lock head
@@ -295,6 +456,13 @@ class CMSet_O : public CMSet<T> {
 
 
         bool remove(const T& element) override {
+            return remove(element, 1) == 1;
+        }
+
+        int remove(const T& element, int n) override {
+            if (n <= 0) {
+                return 0;
+            }
             while (true) { // keep on re-trying, if the node is invalid when writing
                 Node<T>* current = this->head;
                 Node<T>* pred = nullptr;
@@ -305,12 +473,13 @@ class CMSet_O : public CMSet<T> {
                         current->mtx.lock();
 
                         if (is_valid(pred, current)) { // check if node is valid 
-                            if (current->count > 1) { // if multiplicity/count is greater than 1, decrement by 1
-                                current->count--;
+                            if (current->count > n) { // if multiplicity/count is greater than n, decrement by n
+                                current->count -= n;
                                 if (pred != nullptr)  { pred->mtx.unlock(); }
                                 current->mtx.unlock();
-                                return true;
+                                return n;
                             } else {
+                                int removed = current->count; // every copy goes, so the node does too
                                 if (pred == nullptr) { // if there is no pred node, set the 'head' to the succeeding node
                                     this->head = current->next;
                                 } else {
@@ -319,7 +488,7 @@ class CMSet_O : public CMSet<T> {
                                 if (pred != nullptr) { pred->mtx.unlock(); }
                                 current->mtx.unlock();
                                 // delete current; // physically remove current
-                                return true;
+                                return removed;
                             }
                         } else {
                             if (pred != nullptr) { pred->mtx.unlock(); }
@@ -339,180 +508,521 @@ class CMSet_O : public CMSet<T> {
                     pred->mtx.unlock(); //ensure the predecessor is unlocked if we exit the loop
                 }
 
-                // If current is nullptr, we've not found the element, so return false
+                // If current is nullptr, we've not found the element, so nothing removed
                 if (current == nullptr) {
-                    return false; // false indicating element not found
+                    return 0;
                 }
             }
         }
+
+        //locks each node while reading it, so the count is not read mid-update
+        void for_each(const std::function<void(const T&, int)>& visit) override {
+            for (Node<T>* current = this->head; current != nullptr; current = current->next) {
+                current->mtx.lock();
+                int count = current->count;
+                current->mtx.unlock();
+                visit(current->data, count);
+            }
+        }
 }; 
 
 
 /**
  * Lock-free algorithm
  *  w/Lazy Synchronisation
+ *
+ * A node's count doubles as its liveness: the remove that takes the count from 1 to 0 is the point the element leaves the set,
+ * and a node at 0 is dead for good (add() never revives it, it inserts a fresh node instead).
+ * The dead node is then marked (LSB of its next pointer) so no one links past it, and unlinked by whoever gets there first.
+ * Unlinked nodes are not freed, as other threads may still be traversing them (no memory reclamation scheme).
+ *
+ * Instrumented = true counts failed CAS attempts, which CMSet_Adaptive samples. It is off for the standalone strategy,
+ * so the benchmarks measure the algorithm without the extra shared write.
 */
 
-template <typename T>
+template <typename T, bool Instrumented = false>
 class CMSet_Lock_Free : public CMSet<T> {
 
     private:
 
         std::atomic<Node_A<T>*> head = nullptr;
+        std::atomic<long> failed_cas{0}; // number of CAS attempts that lost to another thread (only when Instrumented)
 
-        //mark a node as logically removed
-        //note to self: the reinterpret_cast converts the next pointer to an unsigned integer of the same size, allowing bitwise operations on it
-        // possible due to modern architecturers having a 2-byte boundary for pointers :) 
-        bool mark_node_for_deletion(Node_A<T>* node) {
-            Node_A<T>* expected_next = node->next.load(std::memory_order_relaxed);
-            Node_A<T>* marked_next = reinterpret_cast<Node_A<T>*>(reinterpret_cast<uintptr_t>(expected_next) | 1); // sets the LSB to be 1 
-            return node->next.compare_exchange_strong(expected_next, marked_next, std::memory_order_release, std::memory_order_relaxed); // CAS checking if node->next is still expected_next
+        void cas_failed() {
+            if constexpr (Instrumented) {
+                failed_cas.fetch_add(1, std::memory_order_relaxed);
+            }
         }
 
-        //checks if there is a '1' set on the next pointer.
-        bool is_marked_for_deletion(Node_A<T>* node) {
-            Node_A<T>* next_node = node->next.load(std::memory_order_relaxed);
-            return reinterpret_cast<uintptr_t>(next_node) & 1; //checks if LSB has been set 
+        //checks if there is a '1' set on a next pointer (i.e. the node it was read from is marked for deletion)
+        static bool is_marked(Node_A<T>* next) {
+            return reinterpret_cast<uintptr_t>(next) & 1; //checks if LSB has been set 
         }
 
         //used to unmark the next pointer, so we can use it for other operations (such as traversing)
-        Node_A<T>* clean_marked_bit(Node_A<T>* node_marked) {
+        //note to self: the reinterpret_cast converts the next pointer to an unsigned integer of the same size, allowing bitwise operations on it
+        // possible due to modern architecturers having a 2-byte boundary for pointers :) 
+        static Node_A<T>* clean_marked_bit(Node_A<T>* node_marked) {
             return reinterpret_cast<Node_A<T>*>(reinterpret_cast<uintptr_t>(node_marked) & ~uintptr_t(1)); //clears LSB, of the int representation of pointer. 
         }
 
+        //mark a dead node (count 0) so its next pointer can no longer change, retrying if a helper unlinks its successor meanwhile
+        void mark_node_for_deletion(Node_A<T>* node) {
+            Node_A<T>* expected_next = node->next.load(std::memory_order_acquire);
+            while (!is_marked(expected_next)) {
+                Node_A<T>* marked_next = reinterpret_cast<Node_A<T>*>(reinterpret_cast<uintptr_t>(expected_next) | 1); // sets the LSB to be 1 
+                if (node->next.compare_exchange_weak(expected_next, marked_next, std::memory_order_release, std::memory_order_acquire)) {
+                    return;
+                }
+                cas_failed();
+            }
+        }
+
+        //the live node holding 'element', or nullptr (nodes at count 0 are skipped)
+        Node_A<T>* find_live(const T& element) {
+            Node_A<T>* current = this->head.load(std::memory_order_acquire);
+            while (current != nullptr) {
+                if (current->data == element && current->count.load(std::memory_order_acquire) > 0) {
+                    return current;
+                }
+                current = clean_marked_bit(current->next.load(std::memory_order_acquire)); //move to the next node, by unmarking the next pointer
+            }
+            return nullptr;
+        }
+
+        //takes up to n copies off a node, returns how many it took (0 if the node is, or becomes, dead)
+        //the thread that takes the count to 0 marks the node and tries once to unlink it
+        int take(Node_A<T>* pred, Node_A<T>* current, int n) {
+            int cnt = current->count.load(std::memory_order_acquire);
+            while (cnt > 0) {
+                int taken = std::min(cnt, n);
+                if (current->count.compare_exchange_weak(cnt, cnt - taken)) {
+                    if (cnt == taken) { //last copy gone, the node is dead
+                        mark_node_for_deletion(current);
+                        Node_A<T>* succ = clean_marked_bit(current->next.load(std::memory_order_acquire));
+                        std::atomic<Node_A<T>*>& link = (pred == nullptr) ? this->head : pred->next;
+                        Node_A<T>* expected = current;
+                        if (!link.compare_exchange_strong(expected, succ)) {
+                            cas_failed(); //pred moved on or is dead itself, a later traversal will unlink it
+                        }
+                    }
+                    return taken;
+                }
+                cas_failed(); //count changed underneath us, retry with the new value
+            }
+            return 0;
+        }
+
     public:
 
         CMSet_Lock_Free() : CMSet<T>() {} //constructor
 
+        //bulk-load constructor, links one node per (element, multiplicity) pair in a single pass
+        explicit CMSet_Lock_Free(const std::vector<std::pair<T, int>>& items) : CMSet<T>() {
+            Node_A<T>* first = nullptr;
+            for (auto it = items.rbegin(); it != items.rend(); ++it) { //built back-to-front so the list keeps the order of 'items'
+                Node_A<T>* newNode = new Node_A<T>(it->first, it->second);
+                newNode->next.store(first, std::memory_order_relaxed);
+                first = newNode;
+            }
+            this->head.store(first, std::memory_order_release); //publishes the whole list at once
+        }
+
 
         //Notes for report: WAIT- FREE!
         bool contains(const T& element) override {
-            Node_A<T>* current = this->head.load(std::memory_order_acquire);
-
-            while (current != nullptr) {
-                if (!is_marked_for_deletion(current)) { // check if the node is marked for deletion
-                    if (current->data == element) {
-                        return true; //elemenet has been found
-                    }
-                }
-
-                 //load next node out of comparison to avoid data race
-                Node_A<T>* next = current->next.load(std::memory_order_acquire);
-                current = clean_marked_bit(next); //move to the next node, by unmarking the next pointer
-            } 
-        
-            return false; //Element is not found
+            return find_live(element) != nullptr;
         }
 
         void add(const T& element) override {
-            while (true) { //keep on re-trying, if the node is invalid when writing
-                Node_A<T>* current = this->head.load(std::memory_order_acquire);
-
+            add(element, 1);
+        }
 
+        //there is at most one live node per element: a new node is only linked in if no live one was seen since 'first' was read,
+        //and any insertion (or head unlink) after that changes the head, failing the CAS and forcing a rescan
+        void add(const T& element, int n) override {
+            if (n <= 0) {
+                return;
+            }
+            while (true) { //keep on re-trying, if the node is invalid when writing
+                Node_A<T>* first = this->head.load(std::memory_order_acquire);
 
-                while (current != nullptr) {
+                for (Node_A<T>* current = first; current != nullptr; current = clean_marked_bit(current->next.load(std::memory_order_acquire))) {
                     if (current->data == element) {
-                        // atomically increase count, since element found
+                        // atomically increase count, unless the node has already died (count 0)
                         int cnt = current->count.load(std::memory_order_acquire);
-                        if (current->count.compare_exchange_weak(cnt, cnt + 1)) {
-                            return; //success
-                        } 
-
-                        //if CAS fails (ue to another thread interaction), the loop will restart anyway and try agian
-                    } 
-                    
-                     //load next node out of comparison to avoid data race
-                    Node_A<T>* next = current->next.load(std::memory_order_acquire);
-                    current = clean_marked_bit(next); //move to the next node, by unmarking the next pointer
+                        while (cnt > 0) {
+                            if (current->count.compare_exchange_weak(cnt, cnt + n)) {
+                                return; //success
+                            }
+                            cas_failed();
+                        }
+                        //dead node, keep looking
+                    }
                 }
 
-
                 //prepare new node for insertion
-                Node_A<T>* newNode = new Node_A<T>(element);
-                Node_A<T>* expected = this->head.load(std::memory_order_acquire);
-                newNode->next.store(expected, std::memory_order_relaxed);
+                Node_A<T>* newNode = new Node_A<T>(element, n);
+                newNode->next.store(first, std::memory_order_relaxed);
 
-
-    
                 //attempt to insert new node at head
-                if (head.compare_exchange_weak(expected, newNode, std::memory_order_release, std::memory_order_relaxed)) {
+                if (head.compare_exchange_strong(first, newNode, std::memory_order_release, std::memory_order_relaxed)) {
                     return; //success
                 }
 
+                cas_failed();
                 delete newNode; //once again if CAS fails, another thread must have interfered, so delete newnode and retry ;-;
             }
-
         }
 
         //Notes for report: WAIT- FREE!
         int count(const T& element) override {
-            Node_A<T>* current = this->head.load(std::memory_order_acquire);
-                                    
-            while (current != nullptr) {
+            Node_A<T>* node = find_live(element);
+            if (node == nullptr) {
+                return 0;
+            }
+            int cnt = node->count.load(std::memory_order_acquire);
+            return cnt;
+        }
+
+
+        bool remove(const T& element) override {
+            return remove(element, 1) == 1;
+        }
+
+        //Notes for report: leverages logical removals, for wait-free contains() and count()
+        int remove(const T& element, int n) override {
+            if (n <= 0) {
+                return 0;
+            }
+            while (true) { // keep on re-trying, if the node is invalid when writing
+                Node_A<T>* pred = nullptr;
+                Node_A<T>* current = this->head.load(std::memory_order_acquire);
+                bool restart = false;
+
+                while (current != nullptr) {
+                    Node_A<T>* succ = current->next.load(std::memory_order_acquire);
+
+                    if (is_marked(succ)) { //current is marked for deletion, help unlink it before moving on
+                        std::atomic<Node_A<T>*>& link = (pred == nullptr) ? this->head : pred->next;
+                        Node_A<T>* expected = current;
+                        if (!link.compare_exchange_strong(expected, clean_marked_bit(succ))) {
+                            cas_failed();
+                            restart = true; //pred changed (or is marked itself), restart loop to retry
+                            break;
+                        }
+                        current = clean_marked_bit(succ); //pred stays the same
+                        continue;
+                    }
 
-                if (!is_marked_for_deletion(current)) { // if element are equal and is not marked true
                     if (current->data == element) {
-                        int cnt = current->count.load(std::memory_order_acquire);
-                        return cnt;
+                        int removed = take(pred, current, n);
+                        if (removed > 0) {
+                            return removed; //successful removal
+                        }
                     }
+                    //either another element, or a node that has died but isn't marked yet
+
+                    // continue traversing linked list
+                    pred = current;
+                    current = succ; //not marked, so already clean
                 }
 
-                Node_A<T>* next = current->next.load(std::memory_order_acquire);
-                current = clean_marked_bit(next); //move to the next node, by unmarking the next pointer
+                if (!restart) {
+                    return 0; // element not found, nothing removed
+                }
             }
+        }
 
-            return 0;
+        //skips nodes that are logically removed, like contains() and count()
+        void for_each(const std::function<void(const T&, int)>& visit) override {
+            Node_A<T>* current = this->head.load(std::memory_order_acquire);
+
+            while (current != nullptr) {
+                int cnt = current->count.load(std::memory_order_acquire);
+                if (cnt > 0) {
+                    visit(current->data, cnt);
+                }
+                current = clean_marked_bit(current->next.load(std::memory_order_acquire));
+            }
         }
 
+        bool parallel_writes() const override { return true; }
 
-        //Notes for report: leverages logical removals, for wait-free contains() and count()
-        bool remove(const T& element) override {
-            while (true) { // keep on re-trying, if the node is invalid when writing
-                Node_A<T>* current = this->head.load(std::memory_order_acquire);
-                Node_A<T>* pred = nullptr;
-                Node_A<T>* succ = nullptr; //used to check future nodes in the list for logical deletion mark
+        //used by CMSet_Adaptive to sample contention (always 0 unless Instrumented)
+        long cas_failures() const {
+            return failed_cas.load(std::memory_order_relaxed);
+        }
 
-                while (current != nullptr) {
-                    succ = current->next.load(std::memory_order_acquire); 
-
-                    if (succ != nullptr && is_marked_for_deletion(succ)) { //first, its important to check if successor node is marked for deletion
-                        Node_A<T>* succ_next = clean_marked_bit(succ->next.load(std::memory_order_acquire));
-                        if (current->next.compare_exchange_strong(succ, succ_next)) {
-                            //possible memory reclamation?
-                        } 
-                    } else { //if succ node is not marked
-                        if (current->data == element) {
-                            int cnt = current->count.load(std::memory_order_acquire);
-                            if (cnt > 1) { //if multiplicity/count is greater than 1, decrement by 1
-                                current->count.compare_exchange_weak(cnt, cnt - 1);
-                                return true; //successful removal
-                            }
+        // Destructor, deallocates every node still reachable from the head
+        ~CMSet_Lock_Free() {
+            Node_A<T>* current = this->head.load(std::memory_order_relaxed);
+            while (current != nullptr) {
+                Node_A<T>* next = clean_marked_bit(current->next.load(std::memory_order_relaxed));
+                delete current;
+                current = next;
+            }
+        }
+};
 
-                            if(!mark_node_for_deletion(current)) {
-                                break; //CAS inside Mark method failed, restart loop to retry
-                            }
 
-                            // otherwise if CAS success, physical unlink
-                            if (pred->next.compare_exchange_strong(current, succ)) {
-                                delete current;
-                                return true;
-                            }
+/**
+ * Adaptive strategy
+ * Starts out as a CMSet_Lock, and migrates online to a CMSet_Lock_Free once contention on the single lock is high,
+ * moving back once CAS failures have stayed rare for a while and the set is small again.
+ *
+ * Handover protocol: every operation enters through a gate. A migrating thread closes the gate,
+ * waits for the operations already inside to drain, bulk-loads the elements into the new representation and reopens the gate.
+ * Operations arriving during a migration wait at the gate, so every operation runs entirely against one
+ * representation and the set stays linearizable throughout.
+ *
+ * The gate and the statistics are striped per thread, so on the fast path a thread only writes to its own cache line,
+ * and the only shared line it touches is 'migrating', which is read-only outside of a migration.
+*/
+template <typename T>
+class CMSet_Adaptive : public CMSet<T> {
 
-                            break; //CAS failed for physical unlink, restart loop to retry
-                        }
+    public:
+        enum class Mode { Locked, Lock_Free };
+
+    private:
+        static constexpr size_t STRIPES = 64; //threads beyond this share stripes, which is still correct, just slower
+        static constexpr long MAX_SETTLE_SAMPLES = 64;
+
+        //per-thread counters, padded to a cache line each so threads don't share lines
+        struct alignas(64) Stripe {
+            std::atomic<long> active{0};   //operations currently inside the gate
+            std::atomic<long> ops{0};      //all operations
+            std::atomic<long> writes{0};   //add() and remove() calls
+            std::atomic<long> elements{0}; //net change in total multiplicity
+        };
+
+        Stripe stripes[STRIPES];
+
+        CMSet_Lock<T, true>* locked = nullptr;       //exactly one of these is non-null,
+        CMSet_Lock_Free<T, true>* lock_free = nullptr; //and only changes while the gate is closed
+        CMSet<T>* current = nullptr;
+        Mode mode = Mode::Locked;
+
+        std::atomic<bool> migrating{false};
+
+        //sampler state, only touched while holding sample_mtx
+        std::mutex sample_mtx;
+        long window_ops = 0;         //totals seen at the previous sample
+        long window_writes = 0;
+        long window_contention = 0;
+        long samples_in_mode = 0;    //samples taken since the last migration
+        long calm_samples = 0;       //consecutive Lock_Free samples below to_locked_ratio
+        long settle_samples;         //calm samples needed before moving back, doubled every time the set flip-flops
+
+        //thresholds
+        long sample_interval;
+        double to_lock_free_ratio;    //contended lock acquisitions per operation (reads contend for the single lock too)
+        double to_locked_ratio;       //failed CAS attempts per write (reads never CAS, so only writes are counted)
+        long small_size;              //only migrate back to the single lock at or below this many elements
+
+        static size_t stripe_index() {
+            static std::atomic<size_t> next_index{0};
+            thread_local size_t index = next_index.fetch_add(1, std::memory_order_relaxed) % STRIPES;
+            return index;
+        }
+
+        Stripe& enter() {
+            Stripe& stripe = stripes[stripe_index()];
+            while (true) {
+                while (migrating.load()) {
+                    std::this_thread::yield(); //a migration is in progress, wait at the gate
+                }
+                stripe.active.fetch_add(1);
+                if (!migrating.load()) {
+                    return stripe;
+                }
+                stripe.active.fetch_sub(1); //a migration started between the two checks, back off and wait
+            }
+        }
+
+        void leave(Stripe& stripe) {
+            stripe.active.fetch_sub(1);
+        }
+
+        long sum(std::atomic<long> Stripe::* counter) {
+            long total = 0;
+            for (Stripe& stripe : stripes) {
+                total += (stripe.*counter).load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+        //contention counter of the current representation, call from inside the gate
+        long contention() const {
+            return (mode == Mode::Locked) ? locked->contended_acquires() : lock_free->cas_failures();
+        }
+
+        //called after every operation, every sample_interval operations on a stripe it checks whether to migrate
+        void sample(Stripe& stripe) {
+            long n = stripe.ops.fetch_add(1, std::memory_order_relaxed) + 1;
+            if (n % sample_interval != 0) {
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock(sample_mtx, std::try_to_lock);
+            if (!lock.owns_lock()) {
+                return; //another thread is already sampling
+            }
+
+            Stripe& own = enter();
+            Mode from = mode;
+            long total_contention = contention();
+            leave(own);
+            long total_ops = sum(&Stripe::ops);
+            long total_writes = sum(&Stripe::writes);
+
+            long delta_ops = total_ops - window_ops;
+            long delta_writes = total_writes - window_writes;
+            long delta_contention = total_contention - window_contention;
+            window_ops = total_ops;
+            window_writes = total_writes;
+            window_contention = total_contention;
+            samples_in_mode++;
+
+            if (from == Mode::Locked) {
+                if (delta_ops > 0 && double(delta_contention) / delta_ops > to_lock_free_ratio) {
+                    if (samples_in_mode <= settle_samples) {
+                        settle_samples = std::min(settle_samples * 2, MAX_SETTLE_SAMPLES); //came straight back, be slower to leave next time
                     }
-                    // continue traversing linked list
-                    pred = current;
-                    current = clean_marked_bit(succ); //move to the next node, by unmarking the next pointer
+                    migrate(from, Mode::Lock_Free);
+                }
+            } else {
+                //with no writes in the window there is no evidence the lock would be uncontended, so it doesn't count as calm
+                bool calm = delta_writes > 0 && double(delta_contention) / delta_writes < to_locked_ratio;
+                calm_samples = calm ? calm_samples + 1 : 0;
+                if (calm_samples >= settle_samples && sum(&Stripe::elements) <= small_size) {
+                    migrate(from, Mode::Locked);
+                }
+            }
+        }
+
+        //call while holding sample_mtx
+        void migrate(Mode from, Mode to) {
+            bool expected = false;
+            if (!migrating.compare_exchange_strong(expected, true)) {
+                return; //someone else is migrating
+            }
+            for (Stripe& stripe : stripes) {
+                while (stripe.active.load() != 0) {
+                    std::this_thread::yield(); //wait for the operations already inside the gate to finish
                 }
+            }
 
+            if (mode == from) {
+                //one pass to copy out, one pass to link the new list, so the gate is only closed for O(n)
+                std::vector<std::pair<T, int>> items = current->snapshot();
+                CMSet<T>* old_set = current;
+                if (to == Mode::Locked) {
+                    locked = new CMSet_Lock<T, true>(items);
+                    current = locked;
+                } else {
+                    lock_free = new CMSet_Lock_Free<T, true>(items);
+                    current = lock_free;
+                }
 
-                // If current is nullptr, we've not found the element, so return false
-                if (current == nullptr) {
-                    return false; // false indicating element not found
+                delete old_set;
+                if (from == Mode::Locked) {
+                    locked = nullptr;
+                } else {
+                    lock_free = nullptr;
                 }
+                mode = to;
+
+                //new representation starts with a fresh contention counter
+                window_contention = 0;
+                samples_in_mode = 0;
+                calm_samples = 0;
             }
+
+            migrating.store(false); //reopen the gate
         }
-}; 
+
+    public:
+
+        CMSet_Adaptive(long sample_interval = 1024, double to_lock_free_ratio = 0.05, double to_locked_ratio = 0.01,
+                       long small_size = 256, long settle_samples = 4)
+            : CMSet<T>(), settle_samples(settle_samples), sample_interval(sample_interval),
+              to_lock_free_ratio(to_lock_free_ratio), to_locked_ratio(to_locked_ratio), small_size(small_size) {
+            locked = new CMSet_Lock<T, true>();
+            current = locked;
+        }
+
+        bool contains(const T& element) override {
+            Stripe& stripe = enter();
+            bool result = current->contains(element);
+            leave(stripe);
+            sample(stripe);
+            return result;
+        }
+
+        int count(const T& element) override {
+            Stripe& stripe = enter();
+            int result = current->count(element);
+            leave(stripe);
+            sample(stripe);
+            return result;
+        }
+
+        void add(const T& element) override {
+            add(element, 1);
+        }
+
+        void add(const T& element, int n) override {
+            if (n <= 0) {
+                return;
+            }
+            Stripe& stripe = enter();
+            current->add(element, n);
+            stripe.elements.fetch_add(n, std::memory_order_relaxed);
+            stripe.writes.fetch_add(1, std::memory_order_relaxed);
+            leave(stripe);
+            sample(stripe);
+        }
+
+        bool remove(const T& element) override {
+            return remove(element, 1) == 1;
+        }
+
+        int remove(const T& element, int n) override {
+            if (n <= 0) {
+                return 0;
+            }
+            Stripe& stripe = enter();
+            int removed = current->remove(element, n);
+            stripe.elements.fetch_sub(removed, std::memory_order_relaxed);
+            stripe.writes.fetch_add(1, std::memory_order_relaxed);
+            leave(stripe);
+            sample(stripe);
+            return removed;
+        }
+
+        void for_each(const std::function<void(const T&, int)>& visit) override {
+            Stripe& stripe = enter();
+            current->for_each(visit);
+            leave(stripe);
+        }
+
+        //both representations are safe for concurrent writers
+        bool parallel_writes() const override { return true; }
+
+        //which representation is currently in use (for reporting)
+        Mode current_mode() {
+            Stripe& stripe = enter();
+            Mode result = mode;
+            leave(stripe);
+            return result;
+        }
+
+        // Destructor, deallocates whichever representation is in use
+        ~CMSet_Adaptive() {
+            delete current;
+        }
+};
 
 #endif
\ No newline at end of file
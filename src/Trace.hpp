@@ -0,0 +1,393 @@
+//Operation trace capture for the CMSet implementations
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include "CMSet.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+//the four operations of the CMSet interface, stored as a single byte in the trace
+enum class TraceOp : uint8_t { Contains = 0, Count = 1, Add = 2, Remove = 3 };
+
+//a single recorded operation
+template <typename T>
+struct TraceRecord {
+    uint64_t timestamp_ns; //nanoseconds since the recorder was created
+    uint32_t thread_id;    //index of the thread that issued the operation
+    TraceOp op;
+    T element;
+};
+
+
+/**
+ * Single-producer/single-consumer ring buffer
+ * Only the owning thread pushes, and only the flushing thread pops, so neither side needs a lock.
+ * Flushes are serialised by the recorder, so there is never more than one consumer at a time.
+*/
+template <typename T>
+class TraceRing {
+
+    private:
+        std::vector<TraceRecord<T>> slots;
+        std::atomic<uint64_t> tail{0}; //next slot to write, only modified by the producer
+        std::atomic<uint64_t> head{0}; //next slot to read, only modified by the consumer
+
+    public:
+        std::atomic<uint64_t> dropped{0};
+
+        explicit TraceRing(size_t capacity) : slots(capacity) {}
+
+        //returns false if the ring is full (the consumer hasn't caught up)
+        bool push(const TraceRecord<T>& record) {
+            uint64_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) == slots.size()) {
+                return false;
+            }
+            slots[t % slots.size()] = record;
+            tail.store(t + 1, std::memory_order_release); //publishes the record to the consumer
+            return true;
+        }
+
+        //moves every published record into 'out', freeing the slots for the producer
+        void drain(std::vector<TraceRecord<T>>& out) {
+            uint64_t h = head.load(std::memory_order_relaxed);
+            uint64_t t = tail.load(std::memory_order_acquire);
+            for (; h != t; ++h) {
+                out.push_back(slots[h % slots.size()]);
+            }
+            head.store(h, std::memory_order_release);
+        }
+};
+
+
+//writes/reads an unsigned integer as 'bytes' little-endian bytes, independent of the host byte order
+inline void write_le(std::ostream& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out.put(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+inline uint64_t read_le(std::istream& in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= uint64_t(static_cast<unsigned char>(in.get())) << (8 * i);
+    }
+    return value;
+}
+
+//integral elements are stored little-endian like the other fields, any other trivially copyable type is stored as its raw bytes
+template <typename T>
+void write_element(std::ostream& out, const T& element) {
+    if constexpr (std::is_integral<T>::value) {
+        write_le(out, static_cast<uint64_t>(element), sizeof(T));
+    } else {
+        out.write(reinterpret_cast<const char*>(&element), sizeof(T));
+    }
+}
+
+template <typename T>
+void read_element(std::istream& in, T& element) {
+    if constexpr (std::is_integral<T>::value) {
+        element = static_cast<T>(read_le(in, sizeof(T)));
+    } else {
+        in.read(reinterpret_cast<char*>(&element), sizeof(T));
+    }
+}
+
+
+/**
+ * Recording decorator
+ * Wraps any CMSet, forwards every call to it and logs (op, element, thread, timestamp).
+ * Each thread records into its own ring, so recording adds no shared contention to the wrapped set.
+ * A background thread flushes the rings every flush_interval, and a producer that finds its ring full flushes
+ * it itself, so records are only dropped if the file can't keep up even then (the count is kept in the header).
+ *
+ * Thread ids in the trace are per recorder (0, 1, 2... in order of each thread's first operation).
+ * A ring is handed back when its thread exits, and reused by the next new thread.
+ *
+ * Trace file layout (little-endian, fixed-size records so the file can simply be appended to):
+ *   header: "CMST" | uint32 version | uint32 sizeof(T) | uint64 dropped
+ *   record: uint64 timestamp_ns | uint32 thread_id | uint8 op | T element
+*/
+template <typename T>
+class CMSet_Record : public CMSet<T> {
+
+    static_assert(std::is_trivially_copyable<T>::value, "traced element type must be trivially copyable");
+
+    public:
+        static constexpr uint32_t TRACE_VERSION = 2;
+        static constexpr std::streamoff DROPPED_OFFSET = 12; //position of the dropped count in the header
+
+    private:
+
+        //rings and their owners, shared with the threads so they can hand their ring back on exit
+        //(threads only hold a weak_ptr, so a thread that outlives the recorder just finds it gone)
+        struct Registry {
+            std::mutex mtx; //taken on a thread's first operation, on thread exit and by flush(), never per operation
+            std::vector<std::unique_ptr<TraceRing<T>>> rings;
+            std::vector<bool> in_use;
+            uint32_t next_thread_id = 0;
+        };
+
+        //a thread's ring for one recorder
+        struct Handle {
+            uint64_t recorder_id;
+            std::weak_ptr<Registry> registry;
+            size_t slot;
+            uint32_t thread_id;
+            TraceRing<T>* ring;
+        };
+
+        //every recorder the calling thread has used, returns the rings when the thread exits
+        struct ThreadHandles {
+            std::vector<Handle> handles;
+
+            ~ThreadHandles() {
+                for (Handle& handle : handles) {
+                    std::shared_ptr<Registry> registry = handle.registry.lock();
+                    if (registry) {
+                        std::lock_guard<std::mutex> lock(registry->mtx);
+                        registry->in_use[handle.slot] = false;
+                    }
+                }
+            }
+        };
+
+        static ThreadHandles& thread_handles() {
+            thread_local ThreadHandles handles;
+            return handles;
+        }
+
+        static uint64_t next_recorder_id() {
+            static std::atomic<uint64_t> next_id{0};
+            return next_id.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        CMSet<T>& inner; //the set being traced
+        uint64_t recorder_id; //unique per recorder, so a recorder reusing a freed recorder's address isn't confused with it
+        size_t ring_capacity;
+        std::chrono::steady_clock::time_point start_time;
+        std::shared_ptr<Registry> registry;
+        std::ofstream file;
+        std::mutex file_mtx; //serialises flushes, which makes the flushing thread the single consumer of every ring
+
+        std::thread flusher;
+        std::mutex flusher_mtx;
+        std::condition_variable flusher_cv;
+        bool stopping = false;
+
+        //returns the calling thread's handle, taking a free ring (or creating one) on the thread's first operation
+        Handle& local_handle() {
+            std::vector<Handle>& handles = thread_handles().handles;
+            for (Handle& handle : handles) {
+                if (handle.recorder_id == recorder_id) {
+                    return handle;
+                }
+            }
+
+            //drop handles of recorders that no longer exist, so long-lived threads don't accumulate them
+            handles.erase(std::remove_if(handles.begin(), handles.end(), [](const Handle& handle) {
+                return handle.registry.expired();
+            }), handles.end());
+
+            std::lock_guard<std::mutex> lock(registry->mtx);
+            size_t slot = 0;
+            while (slot < registry->rings.size() && registry->in_use[slot]) {
+                ++slot;
+            }
+            if (slot == registry->rings.size()) {
+                registry->rings.push_back(std::unique_ptr<TraceRing<T>>(new TraceRing<T>(ring_capacity)));
+                registry->in_use.push_back(true);
+            }
+            registry->in_use[slot] = true;
+
+            handles.push_back(Handle{recorder_id, registry, slot, registry->next_thread_id++, registry->rings[slot].get()});
+            return handles.back();
+        }
+
+        void record(TraceOp op, const T& element) {
+            Handle& handle = local_handle();
+            TraceRecord<T> rec;
+            rec.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+            rec.thread_id = handle.thread_id;
+            rec.op = op;
+            rec.element = element;
+
+            if (!handle.ring->push(rec)) {
+                flush(); //ring is full, drain it ourselves rather than lose the record
+                if (!handle.ring->push(rec)) {
+                    handle.ring->dropped.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        void flusher_loop(std::chrono::milliseconds flush_interval) {
+            std::unique_lock<std::mutex> lock(flusher_mtx);
+            while (!stopping) {
+                flusher_cv.wait_for(lock, flush_interval);
+                lock.unlock();
+                flush();
+                lock.lock();
+            }
+        }
+
+    public:
+
+        //ring_capacity is per thread, the rings are flushed every flush_interval and whenever one fills up
+        CMSet_Record(CMSet<T>& inner, const std::string& path, size_t ring_capacity = 1 << 16,
+                     std::chrono::milliseconds flush_interval = std::chrono::milliseconds(100))
+            : CMSet<T>(), inner(inner), recorder_id(next_recorder_id()), ring_capacity(ring_capacity),
+              start_time(std::chrono::steady_clock::now()), registry(std::make_shared<Registry>()),
+              file(path, std::ios::binary | std::ios::trunc) {
+            file.write("CMST", 4);
+            write_le(file, TRACE_VERSION, 4);
+            write_le(file, sizeof(T), 4);
+            write_le(file, 0, 8); //dropped count, rewritten on every flush
+            flusher = std::thread(&CMSet_Record::flusher_loop, this, flush_interval);
+        }
+
+        bool contains(const T& element) override {
+            record(TraceOp::Contains, element);
+            return inner.contains(element);
+        }
+
+        int count(const T& element) override {
+            record(TraceOp::Count, element);
+            return inner.count(element);
+        }
+
+        void add(const T& element) override {
+            record(TraceOp::Add, element);
+            inner.add(element);
+        }
+
+        //recorded as n single adds, which has the same effect when replayed
+        void add(const T& element, int n) override {
+            for (int i = 0; i < n; ++i) {
+                record(TraceOp::Add, element);
+            }
+            inner.add(element, n);
+        }
+
+        bool remove(const T& element) override {
+            record(TraceOp::Remove, element);
+            return inner.remove(element);
+        }
+
+        //recorded as n single removes, which has the same effect when replayed (removes past 0 do nothing)
+        int remove(const T& element, int n) override {
+            for (int i = 0; i < n; ++i) {
+                record(TraceOp::Remove, element);
+            }
+            return inner.remove(element, n);
+        }
+
+        //not one of the traced operations, so it is forwarded without being recorded
+        void for_each(const std::function<void(const T&, int)>& visit) override {
+            inner.for_each(visit);
+        }
+
+        bool parallel_writes() const override {
+            return inner.parallel_writes();
+        }
+
+        //drains every ring and appends the records to the trace file, ordered by timestamp
+        //safe to call while other threads are still recording
+        void flush() {
+            std::lock_guard<std::mutex> lock(file_mtx);
+
+            std::vector<TraceRecord<T>> batch;
+            {
+                std::lock_guard<std::mutex> registry_lock(registry->mtx);
+                for (auto& ring : registry->rings) {
+                    ring->drain(batch);
+                }
+            }
+            //stable, so records from one thread with equal timestamps (coarse clocks) keep the order the thread issued them in
+            std::stable_sort(batch.begin(), batch.end(), [](const TraceRecord<T>& a, const TraceRecord<T>& b) {
+                return a.timestamp_ns < b.timestamp_ns;
+            });
+
+            for (const TraceRecord<T>& rec : batch) {
+                write_le(file, rec.timestamp_ns, 8);
+                write_le(file, rec.thread_id, 4);
+                write_le(file, static_cast<uint8_t>(rec.op), 1);
+                write_element(file, rec.element);
+            }
+
+            //keep the header's dropped count current, then go back to appending
+            file.seekp(DROPPED_OFFSET);
+            write_le(file, dropped(), 8);
+            file.seekp(0, std::ios::end);
+            file.flush();
+        }
+
+        //number of operations that were forwarded but not recorded
+        uint64_t dropped() {
+            std::lock_guard<std::mutex> lock(registry->mtx);
+            uint64_t total = 0;
+            for (auto& ring : registry->rings) {
+                total += ring->dropped.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+        // Destructor, stops the flusher and writes out anything still buffered (the wrapped set is not owned)
+        ~CMSet_Record() {
+            {
+                std::lock_guard<std::mutex> lock(flusher_mtx);
+                stopping = true;
+            }
+            flusher_cv.notify_one();
+            flusher.join();
+            flush();
+        }
+};
+
+
+//reads a trace written by CMSet_Record, returns false if the file is missing or was recorded with a different element type
+//'dropped' is set to the number of operations the recorder could not capture, a non-zero value means the trace is incomplete
+template <typename T>
+bool load_trace(const std::string& path, std::vector<TraceRecord<T>>& records, uint64_t& dropped) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+
+    char magic[4];
+    in.read(magic, 4);
+    uint64_t version = read_le(in, 4);
+    uint64_t element_size = read_le(in, 4);
+    dropped = read_le(in, 8);
+    if (!in || std::memcmp(magic, "CMST", 4) != 0 || version != CMSet_Record<T>::TRACE_VERSION || element_size != sizeof(T)) {
+        return false;
+    }
+
+    records.clear();
+    while (true) {
+        TraceRecord<T> rec;
+        rec.timestamp_ns = read_le(in, 8);
+        rec.thread_id = static_cast<uint32_t>(read_le(in, 4));
+        rec.op = static_cast<TraceOp>(read_le(in, 1));
+        read_element(in, rec.element);
+        if (!in) {
+            break; //end of file (a truncated trailing record is ignored)
+        }
+        records.push_back(rec);
+    }
+
+    return true;
+}
+
+#endif
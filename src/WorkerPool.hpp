@@ -0,0 +1,124 @@
+//Shared worker pool, used to spread bulk CMSet operations across threads
+
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+ * Fixed pool of worker threads, created once on first use and kept for the lifetime of the process
+ * run() hands out task indices to the workers and the calling thread alike, and returns once every task has finished.
+ * Because the caller always takes part, run() makes progress even when all workers are busy (or run() is nested).
+*/
+class WorkerPool {
+
+    private:
+
+        //one call to run(), workers and the caller claim task indices from 'next' until they run out
+        struct Job {
+            const std::function<void(size_t)>* task;
+            size_t num_tasks;
+            std::atomic<size_t> next{0};
+            std::atomic<size_t> done{0};
+            std::mutex mtx;
+            std::condition_variable finished;
+        };
+
+        std::vector<std::thread> workers;
+        std::deque<std::shared_ptr<Job>> jobs;
+        std::mutex mtx; //protects 'jobs' and 'stopping'
+        std::condition_variable available;
+        bool stopping = false;
+
+        static void run_tasks(Job& job) {
+            size_t i;
+            while ((i = job.next.fetch_add(1)) < job.num_tasks) {
+                (*job.task)(i);
+                if (job.done.fetch_add(1) + 1 == job.num_tasks) {
+                    std::lock_guard<std::mutex> lock(job.mtx); //last task, wake the caller
+                    job.finished.notify_all();
+                }
+            }
+        }
+
+        void worker_loop() {
+            while (true) {
+                std::shared_ptr<Job> job;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    available.wait(lock, [this] { return stopping || !jobs.empty(); });
+                    if (stopping) {
+                        return;
+                    }
+                    job = jobs.front();
+                    if (job->next.load() >= job->num_tasks) {
+                        jobs.pop_front(); //every index has been claimed, nothing left for us here
+                        continue;
+                    }
+                }
+                run_tasks(*job);
+            }
+        }
+
+    public:
+
+        explicit WorkerPool(size_t num_workers) {
+            for (size_t i = 0; i < num_workers; ++i) {
+                workers.push_back(std::thread(&WorkerPool::worker_loop, this));
+            }
+        }
+
+        //pool shared by every CMSet, one worker per hardware thread (the caller makes one more)
+        static WorkerPool& shared() {
+            static WorkerPool pool(std::max<size_t>(1, std::thread::hardware_concurrency()));
+            return pool;
+        }
+
+        size_t size() const {
+            return workers.size();
+        }
+
+        //runs task(0) ... task(num_tasks - 1), blocking until all of them are done
+        void run(size_t num_tasks, const std::function<void(size_t)>& task) {
+            if (num_tasks == 0) {
+                return;
+            }
+
+            std::shared_ptr<Job> job = std::make_shared<Job>();
+            job->task = &task;
+            job->num_tasks = num_tasks;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                jobs.push_back(job);
+            }
+            available.notify_all();
+
+            run_tasks(*job);
+
+            std::unique_lock<std::mutex> lock(job->mtx);
+            job->finished.wait(lock, [&job] { return job->done.load() == job->num_tasks; });
+        }
+
+        // Destructor, stops and joins the workers
+        ~WorkerPool() {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            available.notify_all();
+            for (auto& thread : workers) {
+                thread.join();
+            }
+        }
+};
+
+#endif
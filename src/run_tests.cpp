@@ -5,9 +5,14 @@
 #include <vector>
 #include <thread>
 #include <chrono>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <map>
+#include <string>
 
 #include "CMSet.hpp"
+#include "Trace.hpp"
 
 //This is just to stimulate a high-contention scenario
 // We randomly pick between adding, removing, counting and containment checking
@@ -132,12 +137,288 @@ void run_benchmarking_scenario(CMSetType& cmset, int num_threads, int num_ops, i
 
 }
 
+// replays a trace captured with CMSet_Record against any strategy
+// each recorded thread gets its own replay thread, issuing its operations in the original order
+// at_recorded_speed = true waits until each op's original timestamp, otherwise ops are issued back-to-back (maximum speed)
+template<typename CMSetType>
+void run_replay_scenario(CMSetType& cmset, const std::string& trace_path, bool at_recorded_speed) {
+
+    std::vector<TraceRecord<int>> records;
+    uint64_t dropped = 0;
+    if (!load_trace(trace_path, records, dropped)) {
+        std::cout << "Could not load trace '" << trace_path << "'" << std::endl;
+        return;
+    }
+
+    //split the trace back into per-thread streams (the file keeps each thread's records in the order it issued them)
+    std::map<uint32_t, std::vector<TraceRecord<int>>> streams;
+    for (const TraceRecord<int>& rec : records) {
+        streams[rec.thread_id].push_back(rec);
+    }
+
+    std::vector<std::thread> threads;
+    std::vector<double> latencies; //store latencies, average latency per thread
+    latencies.resize(streams.size());
+
+    auto start_time = std::chrono::high_resolution_clock::now(); //start timer for the entire replay
+
+    auto thread_operation = [&](const std::vector<TraceRecord<int>>& stream, int thread_index) {
+        for (const TraceRecord<int>& rec : stream) {
+
+            if (at_recorded_speed) {
+                std::this_thread::sleep_until(start_time + std::chrono::nanoseconds(rec.timestamp_ns));
+            }
+
+            auto start_op = std::chrono::high_resolution_clock::now(); //starts timer for a specific operation
+
+            switch (rec.op) {
+                case TraceOp::Contains:
+                    cmset.contains(rec.element);
+                    break;
+                case TraceOp::Count:
+                    cmset.count(rec.element);
+                    break;
+                case TraceOp::Add:
+                    cmset.add(rec.element);
+                    break;
+                case TraceOp::Remove:
+                    cmset.remove(rec.element);
+                    break;
+            }
+
+            auto end_op = std::chrono::high_resolution_clock::now(); //end of timer for specific operation
+            std::chrono::duration<double, std::milli> op_time = end_op - start_op;
+
+            latencies[thread_index] += op_time.count();
+        }
+        latencies[thread_index] /= stream.size(); // calculates average latency per thread
+    };
+
+    //creating one thread per recorded thread
+    int thread_index = 0;
+    for (const auto& stream : streams) {
+        threads.push_back(std::thread(thread_operation, std::cref(stream.second), thread_index++));
+    }
+
+    //joining threads
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    auto end_time = std::chrono::high_resolution_clock::now(); //end timer for the entire replay
+    std::chrono::duration<double, std::milli> elapsed_time = end_time - start_time;
+
+    double total_latency = 0;
+    for (const double& latency : latencies) {
+        total_latency += latency; //sums up all latencies of each thread
+    }
+
+    std::cout << "Replay of '" << trace_path << "' (" << (at_recorded_speed ? "recorded speed" : "maximum speed") << ") has completed in " << elapsed_time.count() << " milliseconds." << std::endl;
+    std::cout << "Number of Threads: " << streams.size() << std::endl;
+    std::cout << "Total Operations: " << records.size() << std::endl;
+    std::cout << "Dropped while recording: " << dropped << (dropped > 0 ? " (trace is incomplete, replay is not faithful)" : "") << std::endl;
+    std::cout << "Throughput (ops/sec): " << (records.size() * 1000) / elapsed_time.count() << std::endl;
+    std::cout << "Average Latency (ms/ops): " << (streams.empty() ? 0 : total_latency / streams.size()) << std::endl;
+    std::cout << "----------------------------------------------------------------" <<  std::endl;
+
+
+}
+
+// every thread adds and then removes the same few keys, so adds and removes (including of the last copy) race on the same nodes
+// each remove follows the thread's own add, so it must always succeed, and the set must end up empty
+template<typename CMSetType>
+void run_same_key_test(CMSetType& cmset, int num_threads, int num_ops) {
+
+    std::atomic<int> failed_removes{0};
+
+    auto thread_operation = [&](int thread_id) {
+        for (int i = 0; i < num_ops / num_threads; ++i) {
+            cmset.add(i % 3);
+            if (!cmset.remove(i % 3)) {
+                failed_removes++;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.push_back(std::thread(thread_operation, i));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    assert(failed_removes == 0);
+    for (int key = 0; key < 3; ++key) {
+        assert(cmset.count(key) == 0);
+    }
+
+    std::cout << "Same-key add/remove test passed." << std::endl;
+}
+
+// forces CMSet_Adaptive to migrate back and forth while threads keep using it
+// every thread works on its own keys, so it knows exactly what count() must return after each of its operations
+void run_adaptive_migration_test(int num_threads, int num_ops) {
+
+    //switch to lock-free on any contention at all, and straight back whenever there were writes, sampling every 16 ops
+    CMSet_Adaptive<int> cmset(16, -1.0, 1e9, 1 << 30, 1);
+    std::vector<int> mode_changes(num_threads, 0);
+
+    auto thread_operation = [&](int thread_id) {
+        int key = thread_id * 10;
+        int expected = 0;
+        CMSet_Adaptive<int>::Mode last_mode = cmset.current_mode();
+
+        for (int i = 0; i < num_ops / num_threads; ++i) {
+            if (i % 3 == 2) {
+                assert(cmset.remove(key));
+                expected--;
+            } else {
+                cmset.add(key);
+                expected++;
+            }
+            assert(cmset.count(key) == expected);
+            assert(cmset.contains(key) == (expected > 0));
+
+            CMSet_Adaptive<int>::Mode mode = cmset.current_mode();
+            if (mode != last_mode) {
+                mode_changes[thread_id]++;
+                last_mode = mode;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.push_back(std::thread(thread_operation, i));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    //final multiplicities: each thread did 2 adds for every remove
+    int per_thread = num_ops / num_threads;
+    int expected_final = per_thread - 2 * (per_thread / 3); //per_thread / 3 removes, the rest adds
+    for (int i = 0; i < num_threads; ++i) {
+        assert(cmset.count(i * 10) == expected_final);
+    }
+
+    //at least one thread saw it leave the single lock and come back (or the reverse)
+    int most_changes = 0;
+    for (int changes : mode_changes) {
+        most_changes = std::max(most_changes, changes);
+    }
+    assert(most_changes >= 2);
+
+    std::cout << "Adaptive migration test passed (" << most_changes << " mode changes seen by one thread)." << std::endl;
+}
+
+// checks the multiset algebra against the expected multiplicities, 'num_items' distinct elements per set
+// (with num_items >= 128 there is more than one partition, so the worker pool is used when the target allows it)
+// element i has multiplicity i % 4 in the target and i % 3 in the source, plus some elements only the source has
+template<typename TargetType, typename SourceType>
+void run_algebra_test(int num_items) {
+
+    auto fill = [&](TargetType& target, SourceType& source) {
+        for (int i = 0; i < num_items; ++i) {
+            target.add(i, i % 4);
+            source.add(i, i % 3);
+        }
+        for (int i = num_items; i < num_items + num_items / 4; ++i) {
+            source.add(i); //only in the source
+        }
+    };
+
+    {
+        TargetType target; SourceType source; fill(target, source);
+        target.merge_from(source); //sum
+        for (int i = 0; i < num_items; ++i) assert(target.count(i) == i % 4 + i % 3);
+        for (int i = num_items; i < num_items + num_items / 4; ++i) assert(target.count(i) == 1);
+    }
+    {
+        TargetType target; SourceType source; fill(target, source);
+        target.union_with(source); //max
+        for (int i = 0; i < num_items; ++i) assert(target.count(i) == std::max(i % 4, i % 3));
+        for (int i = num_items; i < num_items + num_items / 4; ++i) assert(target.count(i) == 1);
+    }
+    {
+        TargetType target; SourceType source; fill(target, source);
+        target.intersect_with(source); //min
+        for (int i = 0; i < num_items; ++i) assert(target.count(i) == std::min(i % 4, i % 3));
+        for (int i = num_items; i < num_items + num_items / 4; ++i) assert(target.count(i) == 0);
+    }
+    {
+        TargetType target; SourceType source; fill(target, source);
+        target.difference_with(source); //clamped at 0
+        for (int i = 0; i < num_items; ++i) assert(target.count(i) == std::max(0, i % 4 - i % 3));
+        for (int i = num_items; i < num_items + num_items / 4; ++i) assert(target.count(i) == 0);
+        for (int i = 0; i < num_items; ++i) assert(source.count(i) == i % 3); //source is left untouched
+    }
+
+    std::cout << "Multiset algebra test passed (" << num_items << " items)." << std::endl;
+}
+
+// runs the algebra on the worker pool while other threads keep reading the source and writing the target
+// readers check the source never changes under them, during merge/difference a writer works on its own key in the target and checks its counts,
+// and the algebra's own elements must end up with the expected multiplicities
+template<typename TargetType, typename SourceType>
+void run_concurrent_algebra_test(int num_items, int num_readers) {
+
+    TargetType target;
+    SourceType source;
+    for (int i = 0; i < num_items; ++i) {
+        target.add(i, i % 4);
+        source.add(i, i % 3 + 1);
+    }
+
+    std::atomic<bool> done{false};
+    std::atomic<bool> writer_done{false};
+    std::vector<std::thread> threads;
+
+    for (int r = 0; r < num_readers; ++r) {
+        threads.push_back(std::thread([&, r] {
+            for (int i = r; !done; i = (i + 7) % num_items) {
+                assert(source.count(i) == i % 3 + 1);
+                target.contains(i);
+            }
+        }));
+    }
+
+    std::thread writer([&] {
+        int key = num_items * 10; //not in the source, so merge/difference leave it alone
+        while (!writer_done) {
+            target.add(key, 2);
+            assert(target.count(key) == 2);
+            assert(target.remove(key, 5) == 2);
+        }
+    });
+
+    target.merge_from(source);      //t + s
+    target.difference_with(source); //back to t
+    for (int i = 0; i < num_items; ++i) assert(target.count(i) == i % 4);
+
+    writer_done = true; //intersect_with would (correctly) remove the writer's key, as the source doesn't have it
+    writer.join();
+
+    target.intersect_with(source);  //min(t, s)
+    target.union_with(source);      //max(min(t, s), s) = s
+    for (int i = 0; i < num_items; ++i) assert(target.count(i) == i % 3 + 1);
+
+    done = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::cout << "Concurrent multiset algebra test passed (" << num_items << " items, " << num_readers << " readers)." << std::endl;
+}
+
 int main() {
 
     //initialising each strategy
     CMSet_Lock<int> cmset_lock;
     CMSet_O<int> cmset_o;
     CMSet_Lock_Free<int> cmset_lf;
+    CMSet_Adaptive<int> cmset_adaptive;
 
     int num_threads = 4;  // <-- number of threads
     int num_ops = 100; // <-- number of total operations
@@ -155,6 +436,53 @@ int main() {
     run_benchmarking_scenario(cmset_lock, num_threads, num_ops, read_percentage, write_percentage);
     run_benchmarking_scenario(cmset_lf, num_threads, num_ops, read_percentage, write_percentage);
     run_benchmarking_scenario(cmset_o, num_threads, num_ops, read_percentage, write_percentage);
+    run_benchmarking_scenario(cmset_adaptive, num_threads, num_ops, read_percentage, write_percentage);
+
+
+    //------------Example trace capture and replay ------------------------
+    // Wrap a set in CMSet_Record to capture its workload, then replay the same trace against each strategy.
+    // With production traffic, swap the stress test for the real workload and keep the trace file around.
+    {
+        CMSet_Lock<int> cmset_traced;
+        CMSet_Record<int> recorder(cmset_traced, "cmset_trace.bin");
+        run_stress_test(recorder, num_threads, num_ops);
+        recorder.flush();
+        if (recorder.dropped() > 0) {
+            std::cout << "Warning: " << recorder.dropped() << " operations were not recorded" << std::endl;
+        }
+    } // recorder flushes the remaining records to the file when it goes out of scope
+
+    // every replay gets a fresh set, so each one starts from the same (empty) state as the recording
+    CMSet_Lock<int> replay_lock;
+    CMSet_O<int> replay_o;
+    CMSet_Lock_Free<int> replay_lf;
+    CMSet_Adaptive<int> replay_adaptive;
+    CMSet_Lock<int> replay_lock_paced;
+    run_replay_scenario(replay_lock, "cmset_trace.bin", false);
+    run_replay_scenario(replay_lf, "cmset_trace.bin", false);
+    run_replay_scenario(replay_o, "cmset_trace.bin", false);
+    run_replay_scenario(replay_adaptive, "cmset_trace.bin", false);
+    run_replay_scenario(replay_lock_paced, "cmset_trace.bin", true);
+
+
+    //------------Correctness under contention ------------------------
+    CMSet_Lock<int> same_key_lock;
+    CMSet_Lock_Free<int> same_key_lf;
+    CMSet_Adaptive<int> same_key_adaptive(64, -1.0, -1.0, 0, 1); //moves to lock-free at the first sample and stays there
+    run_same_key_test(same_key_lock, 8, 80000);
+    run_same_key_test(same_key_lf, 8, 80000);
+    run_same_key_test(same_key_adaptive, 8, 80000);
+    run_adaptive_migration_test(4, 40000);
+
+
+    //------------Multiset algebra ------------------------
+    // e.g. summing per-window counts into a running total, any strategy can be combined with any other
+    run_algebra_test<CMSet_Lock_Free<int>, CMSet_Lock_Free<int>>(256); //same strategy, parallel partitions
+    run_algebra_test<CMSet_Adaptive<int>, CMSet_Lock<int>>(256);       //mixed, parallel partitions
+    run_algebra_test<CMSet_Lock<int>, CMSet_Lock_Free<int>>(256);      //mixed, single lock target runs inline
+    run_algebra_test<CMSet_Lock_Free<int>, CMSet_Adaptive<int>>(32);   //single partition
+    run_concurrent_algebra_test<CMSet_Lock_Free<int>, CMSet_Lock<int>>(256, 3);
+    run_concurrent_algebra_test<CMSet_Adaptive<int>, CMSet_Lock_Free<int>>(256, 3);
 
 
 